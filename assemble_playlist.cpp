@@ -0,0 +1,211 @@
+/*
+ * Builds per-viewer HLS playlists from the A/B variants written by set_mark -p <dir>.
+ *
+ * <dir>/a/index.m3u8 carries 0 and <dir>/b/index.m3u8 carries 1 in every window, one
+ * segment per window. Segment i of a viewer's playlist is taken from variant b when bit
+ * (i % payload length) of the viewer's payload is 1 and from variant a otherwise, so
+ * marking a viewer costs one playlist write.
+ *
+ * Playlists are written into <dir> and reference the segments as a/... and b/...
+ * Both encodes use the same settings, so their init segments are normally identical and
+ * one EXT-X-MAP (from a) serves the whole playlist; players re-initialise on every map
+ * change, so a new map is only written at variant changes if the two files differ.
+ */
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+
+#define DEBUG 0
+
+typedef struct {
+  std::vector<std::string>  header;           // tags before the first segment
+  std::string               map_uri;          // EXT-X-MAP (fMP4 init segment)
+  std::vector<std::string>  extinf;
+  std::vector<std::string>  uris;
+  int                       target_duration;
+}                           t_playlist;
+
+// print out the steps and errors
+static void logging(const char *fmt, ...);
+
+static int load_playlist(const std::string &filename, t_playlist &playlist)
+{
+  std::ifstream file(filename);
+  std::string   line, extinf;
+
+  if (!file)
+  {
+    std::cerr << "could not open playlist " << filename << std::endl;
+    return -1;
+  }
+  playlist.target_duration = 0;
+  while (std::getline(file, line))
+  {
+    if (!line.empty() && line.back() == '\r')
+      line.pop_back();
+    if (line.empty() || line == "#EXT-X-ENDLIST")
+      continue;
+    if (line.compare(0, 11, "#EXT-X-MAP:") == 0)
+    {
+      size_t start = line.find("URI=\"");
+      size_t end = (start == std::string::npos) ? start : line.find('"', start + 5);
+
+      if (end == std::string::npos)
+      {
+        std::cerr << filename << ": bad EXT-X-MAP" << std::endl;
+        return -1;
+      }
+      playlist.map_uri = line.substr(start + 5, end - start - 5);
+    }
+    else if (line.compare(0, 8, "#EXTINF:") == 0)
+      extinf = line;
+    else if (line.compare(0, 22, "#EXT-X-TARGETDURATION:") == 0)
+      playlist.target_duration = atoi(line.c_str() + 22);
+    else if (line[0] == '#')
+    {
+      if (playlist.uris.empty())
+        playlist.header.push_back(line);
+    }
+    else
+    {
+      if (extinf.empty())
+      {
+        std::cerr << filename << ": segment " << line << " without EXTINF" << std::endl;
+        return -1;
+      }
+      playlist.extinf.push_back(extinf);
+      playlist.uris.push_back(line);
+      extinf.clear();
+    }
+  }
+  logging("%s: %zu segments", filename.c_str(), playlist.uris.size());
+  return 0;
+}
+
+// byte comparison of two files, false if either cannot be read
+static bool same_file(const std::string &name_a, const std::string &name_b)
+{
+  std::ifstream                   fa(name_a, std::ios::binary), fb(name_b, std::ios::binary);
+  std::istreambuf_iterator<char>  end;
+
+  if (!fa || !fb)
+    return false;
+  return std::equal(std::istreambuf_iterator<char>(fa), end, std::istreambuf_iterator<char>(fb), end);
+}
+
+static int write_viewer_playlist(const t_playlist *variants[2], bool shared_map, const std::string &payload,
+                                 std::ostream &out)
+{
+  const char  *names[2] = {"a", "b"};
+  int         prev = -1;
+
+  for (const std::string &line : variants[0]->header)
+    out << line << "\n";
+  out << "#EXT-X-TARGETDURATION:" << std::max(variants[0]->target_duration, variants[1]->target_duration) << "\n";
+  for (size_t i = 0; i < variants[0]->uris.size(); i++)
+  {
+    int v = (payload[i % payload.length()] == '1') ? 1 : 0;
+
+    if (shared_map ? prev < 0 : v != prev)
+    {
+      int m = shared_map ? 0 : v;
+
+      if (!variants[m]->map_uri.empty())
+        out << "#EXT-X-MAP:URI=\"" << names[m] << "/" << variants[m]->map_uri << "\"\n";
+    }
+    prev = v;
+    out << variants[v]->extinf[i] << "\n" << names[v] << "/" << variants[v]->uris[i] << "\n";
+  }
+  out << "#EXT-X-ENDLIST" << std::endl;
+  return out ? 0 : -1;
+}
+
+static bool is_payload(const std::string &s)
+{
+  return !s.empty() && s.find_first_not_of("01") == std::string::npos;
+}
+
+int main(int argc, const char *argv[])
+{
+  t_playlist        a, b;
+  const t_playlist  *variants[2] = {&a, &b};
+
+  if (argc < 3)
+  {
+    printf("Usage: %s <package dir> <payload bits> [output playlist]\n", argv[0]);
+    printf("       %s <package dir> - < \"<viewer id> <payload bits>\" lines\n", argv[0]);
+    return -1;
+  }
+  std::string dir = argv[1];
+  std::string payload = argv[2];
+
+  if (load_playlist(dir + "/a/index.m3u8", a) < 0 || load_playlist(dir + "/b/index.m3u8", b) < 0)
+    return -1;
+  if (a.uris.size() != b.uris.size() || a.uris.empty())
+  {
+    std::cerr << "variants have " << a.uris.size() << " and " << b.uris.size()
+      << " segments, they were not cut on the same windows" << std::endl;
+    return -1;
+  }
+  bool shared_map = (a.map_uri.empty() && b.map_uri.empty())
+    || same_file(dir + "/a/" + a.map_uri, dir + "/b/" + b.map_uri);
+  logging("init segments %s", shared_map ? "are identical" : "differ, a map is written at every variant change");
+
+  if (payload != "-")
+  {
+    if (!is_payload(payload))
+    {
+      std::cerr << "payload must be a bit string" << std::endl;
+      return -1;
+    }
+    if (argc < 4)
+      return write_viewer_playlist(variants, shared_map, payload, std::cout);
+    std::ofstream out(argv[3]);
+    return write_viewer_playlist(variants, shared_map, payload, out);
+  }
+
+  // batch mode: <dir>/<viewer id>.m3u8 for every "<viewer id> <payload bits>" line
+  std::string line;
+  size_t      count = 0;
+  while (std::getline(std::cin, line))
+  {
+    std::istringstream  ss(line);
+    std::string         viewer, bits;
+
+    if (!(ss >> viewer) || viewer[0] == '#')
+      continue;
+    if (!(ss >> bits) || !is_payload(bits) || viewer.find('/') != std::string::npos)
+    {
+      std::cerr << "skipping bad line: " << line << std::endl;
+      continue;
+    }
+    std::ofstream out(dir + "/" + viewer + ".m3u8");
+    if (write_viewer_playlist(variants, shared_map, bits, out) < 0)
+    {
+      std::cerr << "could not write playlist of " << viewer << std::endl;
+      return -1;
+    }
+    count++;
+  }
+  std::cout << count << " playlists written to " << dir << std::endl;
+  return 0;
+}
+
+static void logging(const char *fmt, ...)
+{
+  #if DEBUG == 1
+    va_list args;
+    fprintf( stderr, "LOG: " );
+    va_start( args, fmt );
+    vfprintf( stderr, fmt, args );
+    va_end( args );
+    fprintf( stderr, "\n" );
+  #endif
+}
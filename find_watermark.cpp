@@ -25,6 +25,12 @@ extern "C"
 #include <string>
 #include <iostream>
 #include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include "tiles.h"
+#include "topology.h"
 
 #define DEBUG 0
 
@@ -36,71 +42,222 @@ typedef struct {
   AVFormatContext   *fctx;
   AVMediaType       media_type;
 }                   t_stream_params;
+
+/*
+ * Binary per-frame trace (-T), native byte order:
+ *   t_trace_header, then one record per decoded frame:
+ *   frame index (u64), pts in the stream time base (i64), window (u32), phase in window (u32),
+ *   marked pixels per tile (u32 * ntiles)
+ */
+typedef struct {
+  char      magic[4];       // "WMTR"
+  uint16_t  version;
+  uint16_t  ntiles;
+  uint32_t  frame_key;
+  int32_t   time_base_num;
+  int32_t   time_base_den;
+  uint32_t  record_size;
+}           t_trace_header;
+static_assert(sizeof(t_trace_header) == 24, "trace header must stay packed");
+
+#define TRACE_VERSION     1
+#define TRACE_RECORD_HEAD 24
+
+// packets buffered per stream between the demuxer and the decoder worker
+#define MAX_QUEUED_PACKETS 64
+
+struct s_source;
+
+// decoder and mark counter of one video stream (rendition)
+typedef struct s_detector {
+  std::string                             name;
+  struct s_source                         *source;
+  int                                     stream_index;
+  AVRational                              time_base;
+  AVCodecContext                          *codec_ctx;
+  AVFrame                                 *frame;
+  uint64_t                                frame_count = 0;
+  std::vector<std::vector<unsigned int>>  frame_marks;
+  std::string                             bits;
+  std::string                             out_s;
+  bool                                    echo = false;
+  bool                                    failed = false;
+  FILE                                    *trace_file = nullptr;
+  std::vector<uint8_t>                    trace_record;
+  std::deque<AVPacket *>                  queue;
+  std::mutex                              mutex;
+  std::condition_variable                 cond;
+  std::thread                             worker;
+}                                         t_detector;
+
+// one input file, demuxed once for all of its detectors
+typedef struct s_source {
+  std::string               filename;
+  AVFormatContext           *fctx = nullptr;
+  std::vector<t_detector *> by_stream;
+}                           t_source;
+
 // print out the steps and errors
 static void logging(const char *fmt, ...);
-// decode packets into frames
-static int decode_packet(AVPacket *pPacket, AVCodecContext *pCodecContext, AVFrame *pFrame);
+// decode packets into frames, a null packet flushes the decoder
+static int decode_packet(t_detector *det, AVPacket *pPacket);
 // save a frame into a .pgm file
 static void save_gray_frame(unsigned char *buf, int wrap, int xsize, int ysize, char *filename);
 
 
-static unsigned int get_watermark(unsigned char *buf_y, unsigned char *buf_cb, unsigned char *buf_cr, 
-                            int wrap_y, int wrap_cb, int wrap_cr, int xsize, int ysize)
+// count the marked pixels of every tile in one pass, counts[k] belongs to tiles[k];
+// false if a tile does not fit into the frame
+static bool get_watermark(unsigned char *buf_y, unsigned char *buf_cb, unsigned char *buf_cr, 
+                            int wrap_y, int wrap_cb, int wrap_cr, int xsize, int ysize,
+                            const std::vector<t_tile> &tiles, std::vector<unsigned int> &counts)
 {
-  int           watermarksize = 75;
-  unsigned int  amount_of_marked_pixel = 0;
+  int           watermarksize = WATERMARK_DETECT_SIZE;
   uint32_t      tmp_CB_index;
   bool          res;
 
-  for (unsigned int i = (ysize - watermarksize); i < ysize; i++)
+  counts.assign(tiles.size(), 0);
+  for (size_t t = 0; t < tiles.size(); t++)
   {
-    tmp_CB_index = (i / 2) * wrap_cb;
-    for (unsigned int j = (xsize - watermarksize), k = 0; j < xsize && k < watermarksize; j++, k++)
+    unsigned int  amount_of_marked_pixel = 0;
+    unsigned int  x0, y0;
+
+    // the tiles were checked against the stream size, only a size change midstream gets here
+    if (!resolve_tile(tiles[t], xsize, ysize, x0, y0))
+      return false;
+    // read the bottom-right part of the tile
+    x0 += WATERMARK_SIZE - watermarksize;
+    y0 += WATERMARK_SIZE - watermarksize;
+    for (unsigned int i = y0; i < y0 + watermarksize; i++)
     {
-        uint64_t arr_index = i * watermarksize + k;
-        uint32_t CB_index =  tmp_CB_index + (j / 2);
-
-        //res = (*buf_y  & 0x3u) >= 0x2u ? true : false;
-        //res = (*buf_y  & 0x3u) >= 0x2u ? true : false;
-        res = (*(buf_cb + CB_index) & 0x3u) >= 0x2u ? true : false;
-        //res &= (*(buf_cr + CB_index) & 0x3u) >= 0x2u ? true : false;
-        if (res == true)
-          amount_of_marked_pixel++;
+      tmp_CB_index = (i / 2) * wrap_cb;
+      for (unsigned int j = x0; j < x0 + watermarksize; j++)
+      {
+          uint32_t CB_index =  tmp_CB_index + (j / 2);
 
-        buf_y++;
+          //res = (*buf_y  & 0x3u) >= 0x2u ? true : false;
+          res = (*(buf_cb + CB_index) & 0x3u) >= 0x2u ? true : false;
+          //res &= (*(buf_cr + CB_index) & 0x3u) >= 0x2u ? true : false;
+          if (res == true)
+            amount_of_marked_pixel++;
+      }
     }
+    counts[t] = amount_of_marked_pixel;
   }
-  return amount_of_marked_pixel;
+  return true;
 }
 
-uint64_t frame_count;
-std::vector<unsigned int> frame_marks;
-std::string out_s;
+const uint64_t frame_key = 14;
+std::vector<t_tile> tiles;
 
-int main(int argc, const char *argv[])
+static int open_trace(t_detector *det, const std::string &filename, AVRational time_base)
 {
-  frame_count = 0;
-  if (argc < 2) {
-    printf("You need to specify a media file.\n");
+  t_trace_header header;
+
+  det->trace_file = fopen(filename.c_str(), "wb");
+  if (!det->trace_file)
+  {
+    std::cerr << "could not open trace file " << filename << std::endl;
     return -1;
   }
-  std::vector<t_stream_params>  output_streams;
-  
-  logging("initializing all the containers, codecs and protocols.");
+  setvbuf(det->trace_file, NULL, _IOFBF, 1 << 20);
+  memcpy(header.magic, "WMTR", 4);
+  header.version = TRACE_VERSION;
+  header.ntiles = tiles.size();
+  header.frame_key = frame_key;
+  header.time_base_num = time_base.num;
+  header.time_base_den = time_base.den;
+  header.record_size = TRACE_RECORD_HEAD + 4 * tiles.size();
+  det->trace_record.resize(header.record_size);
+  if (fwrite(&header, sizeof(header), 1, det->trace_file) != 1)
+  {
+    std::cerr << "could not write trace file " << filename << std::endl;
+    return -1;
+  }
+  return 0;
+}
+
+static void write_trace(t_detector *det, int64_t pts, const std::vector<unsigned int> &counts)
+{
+  uint8_t   *rec = det->trace_record.data();
+  uint32_t  window = det->frame_count / frame_key;
+  uint32_t  phase = det->frame_count % frame_key;
+
+  memcpy(rec, &det->frame_count, 8);
+  memcpy(rec + 8, &pts, 8);
+  memcpy(rec + 16, &window, 4);
+  memcpy(rec + 20, &phase, 4);
+  for (size_t k = 0; k < counts.size(); k++)
+  {
+    uint32_t count = counts[k];
 
+    memcpy(rec + TRACE_RECORD_HEAD + 4 * k, &count, 4);
+  }
+  fwrite(rec, det->trace_record.size(), 1, det->trace_file);
+}
 
+// open the decoder of one video stream
+static t_detector *open_detector(t_source *source, int stream_index, AVCodec *pCodec)
+{
+  AVStream    *stream = source->fctx->streams[stream_index];
+  t_detector  *det = new t_detector();
+
+  det->name = source->filename + "#" + std::to_string(stream_index) + " "
+    + std::to_string(stream->codecpar->width) + "x" + std::to_string(stream->codecpar->height);
+  det->stream_index = stream_index;
+  det->time_base = stream->time_base;
+  det->codec_ctx = avcodec_alloc_context3(pCodec);
+  if (!det->codec_ctx)
+  {
+    logging("failed to allocated memory for AVCodecContext");
+    return nullptr;
+  }
+  if (avcodec_parameters_to_context(det->codec_ctx, stream->codecpar) < 0)
+  {
+    logging("failed to copy codec params to codec context");
+    return nullptr;
+  }
+  if (avcodec_open2(det->codec_ctx, pCodec, NULL) < 0)
+  {
+    logging("failed to open codec through avcodec_open2");
+    return nullptr;
+  }
+  det->frame = av_frame_alloc();
+  if (!det->frame)
+  {
+    logging("failed to allocated memory for AVFrame");
+    return nullptr;
+  }
+  return det;
+}
+
+static void close_detector(t_detector *det)
+{
+  if (det->trace_file)
+    fclose(det->trace_file);
+  av_frame_free(&det->frame);
+  avcodec_free_context(&det->codec_ctx);
+  delete det;
+}
+
+// open the input and a detector for its first (or, with all_streams, every) video stream;
+// renditions the tiles do not fit into are skipped, the source may end up with no detector
+static int open_source(t_source *source, bool all_streams, std::vector<t_detector *> &detectors)
+{
   AVFormatContext *pFormatContext = avformat_alloc_context();
+  const char      *input_filename = source->filename.c_str();
+
   if (!pFormatContext) {
     logging("ERROR could not allocate memory for Format Context");
     return -1;
   }
 
-  logging("opening the input file (%s) and loading format (container) header", argv[1]);
+  logging("opening the input file (%s) and loading format (container) header", input_filename);
 
-  if (avformat_open_input(&pFormatContext, argv[1], NULL, NULL) != 0) {
+  if (avformat_open_input(&pFormatContext, input_filename, NULL, NULL) != 0) {
     logging("ERROR could not open the file");
     return -1;
   }
+  source->fctx = pFormatContext;
 
   logging("format %s, duration %lld us, bit_rate %lld", pFormatContext->iformat->name, pFormatContext->duration, pFormatContext->bit_rate);
 
@@ -111,13 +268,9 @@ int main(int argc, const char *argv[])
     return -1;
   }
 
-
-  AVCodec *pCodec = NULL;
-
-  AVCodecParameters *pCodecParameters =  NULL;
-  int video_stream_index = -1;
-
-  for (int i = 0; i < pFormatContext->nb_streams; i++)
+  bool has_video = false;
+  source->by_stream.assign(pFormatContext->nb_streams, nullptr);
+  for (unsigned int i = 0; i < pFormatContext->nb_streams; i++)
   {
     AVCodecParameters *pLocalCodecParameters =  NULL;
     pLocalCodecParameters = pFormatContext->streams[i]->codecpar;
@@ -138,10 +291,24 @@ int main(int argc, const char *argv[])
     }
 
     if (pLocalCodecParameters->codec_type == AVMEDIA_TYPE_VIDEO) {
-      if (video_stream_index == -1) {
-        video_stream_index = i;
-        pCodec = pLocalCodec;
-        pCodecParameters = pLocalCodecParameters;
+      // cover art is a one picture video stream, not a rendition
+      if (pFormatContext->streams[i]->disposition & AV_DISPOSITION_ATTACHED_PIC)
+        continue;
+      has_video = true;
+      if (all_streams || detectors.empty() || detectors.back()->source != source) {
+        t_detector *det = open_detector(source, i, pLocalCodec);
+
+        if (!det)
+          return -1;
+        if (!check_tiles(tiles, det->codec_ctx->width, det->codec_ctx->height))
+        {
+          std::cerr << det->name << ": skipped, the tiles do not fit" << std::endl;
+          close_detector(det);
+          continue;
+        }
+        det->source = source;
+        source->by_stream[i] = det;
+        detectors.push_back(det);
       }
 
       logging("Video Codec: resolution %d x %d", pLocalCodecParameters->width, pLocalCodecParameters->height);
@@ -152,66 +319,225 @@ int main(int argc, const char *argv[])
     logging("\tCodec %s ID %d bit_rate %lld", pLocalCodec->name, pLocalCodec->id, pLocalCodecParameters->bit_rate);
   }
 
-  if (video_stream_index == -1) {
-    logging("File %s does not contain a video stream!", argv[1]);
+  for (unsigned int i = 0; i < pFormatContext->nb_streams; i++)
+  {
+    // the demuxer does not have to read streams nobody decodes
+    if (!source->by_stream[i])
+      pFormatContext->streams[i]->discard = AVDISCARD_ALL;
+  }
+  if (!has_video) {
+    logging("File %s does not contain a video stream!", input_filename);
     return -1;
   }
+  return 0;
+}
+
+static void push_packet(t_detector *det, AVPacket *pPacket)
+{
+  std::unique_lock<std::mutex> lock(det->mutex);
 
-  AVCodecContext *pCodecContext = avcodec_alloc_context3(pCodec);
-  if (!pCodecContext)
+  det->cond.wait(lock, [det] { return det->queue.size() < MAX_QUEUED_PACKETS; });
+  det->queue.push_back(pPacket);
+  det->cond.notify_all();
+}
+
+static AVPacket *pop_packet(t_detector *det)
+{
+  std::unique_lock<std::mutex> lock(det->mutex);
+  AVPacket                     *pPacket;
+
+  det->cond.wait(lock, [det] { return !det->queue.empty(); });
+  pPacket = det->queue.front();
+  det->queue.pop_front();
+  det->cond.notify_all();
+  return pPacket;
+}
+
+// decoder/counter worker of one stream, a null packet ends the stream
+static void detector_worker(t_detector *det)
+{
+  AVPacket *pPacket;
+
+  while ((pPacket = pop_packet(det)) != nullptr)
   {
-    logging("failed to allocated memory for AVCodecContext");
-    return -1;
+    if (!det->failed && decode_packet(det, pPacket) < 0)
+      det->failed = true;
+    av_packet_free(&pPacket);
+  }
+  // frames the decoder still holds for reordering
+  if (!det->failed && decode_packet(det, nullptr) < 0)
+    det->failed = true;
+}
+
+// one pass over the input; packets go to the decoder of their stream, or to its worker when threaded
+static void demux_source(t_source *source, bool threaded)
+{
+  AVPacket  *pPacket = av_packet_alloc();
+  bool      failed = false;
+
+  if (!pPacket)
+  {
+    logging("failed to allocated memory for AVPacket");
+    return;
   }
+  while (av_read_frame(source->fctx, pPacket) >= 0)
+  {
+    t_detector *det = nullptr;
+
+    if (pPacket->stream_index < (int)source->by_stream.size())
+      det = source->by_stream[pPacket->stream_index];
+    if (det && threaded)
+    {
+      AVPacket *queued = av_packet_alloc();
 
-  if (avcodec_parameters_to_context(pCodecContext, pCodecParameters) < 0)
+      if (queued)
+      {
+        av_packet_move_ref(queued, pPacket);
+        push_packet(det, queued);
+      }
+    }
+    else if (det && decode_packet(det, pPacket) < 0)
+    {
+      av_packet_unref(pPacket);
+      failed = true;
+      break;
+    }
+    av_packet_unref(pPacket);
+  }
+  // the workers flush their decoders when the stream ends
+  for (t_detector *det : source->by_stream)
   {
-    logging("failed to copy codec params to codec context");
-    return -1;
+    if (det && threaded)
+      push_packet(det, nullptr);
+    else if (det && !failed)
+      decode_packet(det, nullptr);
   }
+  av_packet_free(&pPacket);
+}
 
-  if (avcodec_open2(pCodecContext, pCodec, NULL) < 0)
+int main(int argc, const char *argv[])
+{
+  int opt;
+
+  tiles = default_tiles();
+  int placement_request = PLACEMENT_AUTO;
+  t_placement placement;
+  const char *trace_filename = nullptr;
+  bool all_streams = false;
+  while ((opt = getopt(argc, (char * const *)argv, "t:T:aN:")) != -1)
   {
-    logging("failed to open codec through avcodec_open2");
+    switch (opt)
+    {
+      case 'N':
+        if (!parse_placement(optarg, placement_request))
+        {
+          std::cerr << "bad placement, expected a NUMA node, \"auto\" or \"off\"" << std::endl;
+          return -1;
+        }
+        break;
+      case 'a':
+        all_streams = true;
+        break;
+      case 'T':
+        trace_filename = optarg;
+        break;
+      case 't':
+        if (!parse_tiles(optarg, tiles))
+        {
+          std::cerr << "bad tile list, expected \"x,y;x,y;...\"" << std::endl;
+          return -1;
+        }
+        break;
+      default:
+        printf("Usage: %s [-t x,y;x,y;...] [-T trace file] [-a] [-N node|auto|off] <media file> [rendition file ...]\n", argv[0]);
+        return -1;
+    }
+  }
+  if (optind >= argc) {
+    printf("You need to specify a media file.\n");
     return -1;
   }
+  // before anything allocates frames or starts threads
+  if (apply_placement(placement_request, placement) < 0)
+    return -1;
+  report_placement(placement);
+
+  logging("initializing all the containers, codecs and protocols.");
+
+  std::vector<t_source *>   sources;
+  std::vector<t_detector *> detectors;
 
-  AVFrame *pFrame = av_frame_alloc();
-  if (!pFrame)
+  for (int i = optind; i < argc; i++)
   {
-    logging("failed to allocated memory for AVFrame");
-    return -1;
+    t_source  *source = new t_source();
+    size_t    opened = detectors.size();
+
+    source->filename = argv[i];
+    if (open_source(source, all_streams, detectors) < 0)
+      return -1;
+    if (detectors.size() == opened)
+    {
+      // every rendition of the file was skipped
+      avformat_close_input(&source->fctx);
+      delete source;
+      continue;
+    }
+    sources.push_back(source);
   }
-  AVPacket *pPacket = av_packet_alloc();
-  if (!pPacket)
+  if (detectors.empty())
   {
-    logging("failed to allocated memory for AVPacket");
+    std::cerr << "no rendition the tiles fit into" << std::endl;
     return -1;
   }
 
-  int response = 0;
-  int how_many_packets_to_process = 8;
+  for (size_t i = 0; trace_filename && i < detectors.size(); i++)
+  {
+    std::string filename = trace_filename;
 
+    // one trace per rendition: <trace file>.<n>
+    if (detectors.size() > 1)
+      filename += "." + std::to_string(i);
+    if (open_trace(detectors[i], filename, detectors[i]->time_base) < 0)
+      return -1;
+  }
 
-  frame_marks = std::vector<unsigned int>();
-  while (av_read_frame(pFormatContext, pPacket) >= 0)
+  if (detectors.size() == 1)
   {
-    if (pPacket->stream_index == video_stream_index) {
-      response = decode_packet(pPacket, pCodecContext, pFrame);
-      if (response < 0)
-        break;
+    // a single stream is decoded on the demuxing thread, bits are printed as they are found
+    detectors[0]->echo = true;
+    demux_source(sources[0], false);
+    std::cout << std::endl;
+  }
+  else
+  {
+    std::vector<std::thread> demuxers;
+
+    for (t_detector *det : detectors)
+      det->worker = std::thread(detector_worker, det);
+    for (size_t i = 1; i < sources.size(); i++)
+      demuxers.push_back(std::thread(demux_source, sources[i], true));
+    demux_source(sources[0], true);
+    for (std::thread &demuxer : demuxers)
+      demuxer.join();
+    for (t_detector *det : detectors)
+    {
+      det->worker.join();
+      std::cout << det->name << ": " << det->bits << std::endl;
     }
-    av_packet_unref(pPacket);
   }
-  std::cout << std::endl;
   logging("releasing all the resources");
-  #if DEBUG == 1
-    std::cout << out_s;
-  #endif
-  avformat_close_input(&pFormatContext);
-  av_packet_free(&pPacket);
-  av_frame_free(&pFrame);
-  avcodec_free_context(&pCodecContext);
+  for (t_detector *det : detectors)
+  {
+    #if DEBUG == 1
+      std::cout << det->name << ": " << det->out_s << std::endl;
+    #endif
+    close_detector(det);
+  }
+  for (t_source *source : sources)
+  {
+    avformat_close_input(&source->fctx);
+    delete source;
+  }
   return 0;
 }
 
@@ -227,10 +553,11 @@ static void logging(const char *fmt, ...)
   #endif
 }
 
-static int decode_packet(AVPacket *pPacket, AVCodecContext *pCodecContext, AVFrame *pFrame)
+static int decode_packet(t_detector *det, AVPacket *pPacket)
 {
-  uint64_t first_skipped_frames = 10;
-  int response = avcodec_send_packet(pCodecContext, pPacket);
+  AVCodecContext  *pCodecContext = det->codec_ctx;
+  AVFrame         *pFrame = det->frame;
+  int             response = avcodec_send_packet(pCodecContext, pPacket);
 
   if (response < 0) {
     logging("Error while sending a packet to the decoder: %d", response);
@@ -248,7 +575,6 @@ static int decode_packet(AVPacket *pPacket, AVCodecContext *pCodecContext, AVFra
     }
 
     if (response >= 0) {
-      uint64_t frame_key = 14;
       uint64_t half_key = frame_key / 2;
       uint64_t key_0_1 = frame_key / 10 + ((frame_key % 10 >= 5) ? 1 : 0);
       uint64_t first_period_start  = key_0_1;
@@ -261,28 +587,44 @@ static int decode_packet(AVPacket *pPacket, AVCodecContext *pCodecContext, AVFra
         logging("Warning: the generated file may not be a grayscale image, but could e.g. be just the R component if the video format is RGB");
       }
 
-      unsigned int ans = get_watermark(pFrame->data[0], pFrame->data[1], pFrame->data[2], pFrame->linesize[0], pFrame->linesize[1], pFrame->linesize[2], pFrame->width, pFrame->height);
-      frame_marks.push_back(ans);
-      if (frame_marks.size() == frame_key)
+      std::vector<unsigned int> ans;
+
+      if (!get_watermark(pFrame->data[0], pFrame->data[1], pFrame->data[2], pFrame->linesize[0], pFrame->linesize[1], pFrame->linesize[2], pFrame->width, pFrame->height, tiles, ans))
       {
-        unsigned int first_half_block_sum = 0, second_half_block_sum = 0;
-        uint64_t i = first_period_start;
+        std::cerr << det->name << ": frame " << det->frame_count << " is " << pFrame->width << "x"
+          << pFrame->height << ", the tiles do not fit into it" << std::endl;
+        return -1;
+      }
+      if (det->trace_file)
+        write_trace(det, pFrame->best_effort_timestamp, ans);
+      det->frame_marks.push_back(ans);
+      if (det->frame_marks.size() == frame_key)
+      {
+        // tile k carries bit k of the window, keep them in message order
+        for (size_t k = 0; k < tiles.size(); k++)
+        {
+          unsigned int first_half_block_sum = 0, second_half_block_sum = 0;
+          uint64_t i = first_period_start;
 
-        for (; i < first_period_end; i++) { first_half_block_sum += frame_marks[i]; }
-        first_half_block_sum /= (half_key - key_0_1);
+          for (; i < first_period_end; i++) { first_half_block_sum += det->frame_marks[i][k]; }
+          first_half_block_sum /= (half_key - key_0_1);
 
-        for (; i < second_period_start; i++) {}
-        for (; i < second_period_end; i++) { second_half_block_sum += frame_marks[i]; }
-        second_half_block_sum /= (half_key - key_0_1);
+          for (; i < second_period_start; i++) {}
+          for (; i < second_period_end; i++) { second_half_block_sum += det->frame_marks[i][k]; }
+          second_half_block_sum /= (half_key - key_0_1);
 
-        if (first_half_block_sum > second_half_block_sum) std::cout << "0";
-        else                                              std::cout << "1";
+          det->bits += (first_half_block_sum > second_half_block_sum) ? "0" : "1";
+          if (det->echo)
+            std::cout << det->bits.back();
+        }
 
-        frame_marks.clear();
+        det->frame_marks.clear();
       }
-      out_s.append(std::to_string(ans) + ", ");
-
+      #if DEBUG == 1
+        det->out_s.append(std::to_string(ans[0]) + ", ");
+      #endif
+      det->frame_count++;
     }
   }
   return 0;
-}
\ No newline at end of file
+}
@@ -14,6 +14,9 @@ extern "C"
 {
   #include <libavcodec/avcodec.h>
   #include <libavformat/avformat.h>
+  #include <libavfilter/avfilter.h>
+  #include <libavfilter/buffersink.h>
+  #include <libavfilter/buffersrc.h>
   #include <libavutil/opt.h>
 }
 #include <unistd.h>
@@ -22,9 +25,14 @@ extern "C"
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <errno.h>
+#include <sys/stat.h>
 #include <string>
 #include <iostream>
+#include <fstream>
 #include <vector>
+#include "tiles.h"
+#include "topology.h"
 
 #define DEBUG 0
 
@@ -35,31 +43,43 @@ typedef struct {
   AVStream          *stream;
   AVFormatContext   *fctx;
   AVMediaType       media_type;
+  uint64_t          key_packets;
 }                   t_stream_params;
 // print out the steps and errors
 static void logging(const char *fmt, ...);
-// decode packets into frames
+// decode packets into frames, a null packet flushes the decoder
 static int decode_packet(AVPacket *pPacket, AVCodecContext *pCodecContext, 
                          AVFrame *pFrame, t_stream_params *stream_params,
                          AVFormatContext *input_fctx, int stream_id,
                          const std::string message, int &mess_index);
 // save a frame into a .pgm file
 static void save_gray_frame(unsigned char *buf, int wrap, int xsize, int ysize, char *filename);
-
-
-static void set_watermark(unsigned char *buf_y, unsigned char *buf_cb, unsigned char *buf_cr, 
-                            int wrap_y, int wrap_cb, int wrap_cr, int xsize, int ysize, bool is_one)
+// mark and encode every frame the filtergraph can give out now
+static int drain_filters(t_stream_params *stream_params, AVFormatContext *input_fctx, int stream_id,
+                         const std::string &message, int &mess_index);
+// mark a decoded (and filtered) frame and pass it to the encoder
+static int mark_and_encode_frame(AVFrame *pFrame, t_stream_params *stream_params,
+                                 AVFormatContext *input_fctx, int stream_id,
+                                 const std::string &message, int &mess_index);
+
+
+static bool set_watermark(unsigned char *buf_y, unsigned char *buf_cb, unsigned char *buf_cr, 
+                            int wrap_y, int wrap_cb, int wrap_cr, int xsize, int ysize,
+                            const t_tile &tile, bool is_one)
 {
-  int watermarksize = 100;
+  int watermarksize = WATERMARK_SIZE;
   #if 1
   uint32_t tmp_CB_index;
   unsigned char mark;
+  unsigned int x0, y0;
 
-
-  for (unsigned int i = (ysize - watermarksize); i < ysize; i++)
+  // the tiles were checked against the stream size, only a size change midstream gets here
+  if (!resolve_tile(tile, xsize, ysize, x0, y0))
+    return false;
+  for (unsigned int i = y0; i < y0 + watermarksize; i++)
   {
     tmp_CB_index = (i / 2) * wrap_cb;
-    for (unsigned int j = (xsize - watermarksize); j < xsize; j++)
+    for (unsigned int j = x0; j < x0 + watermarksize; j++)
     {
         uint32_t CB_index =  tmp_CB_index + (j / 2);
         unsigned char *p_cb = buf_cb + CB_index;
@@ -92,9 +112,102 @@ static void set_watermark(unsigned char *buf_y, unsigned char *buf_cb, unsigned
         }
     } 
   #endif     
+  return true;
 }
 
 
+AVFilterGraph   *filter_graph = nullptr;
+AVFilterContext *buffersrc_ctx = nullptr;
+AVFilterContext *buffersink_ctx = nullptr;
+
+// buffersrc -> filters_descr -> buffersink, the sink only gives out yuv420p which set_watermark expects
+int init_filters(const char *filters_descr, AVFormatContext *input_fctx, int stream_id, AVCodecContext *decoder_ctx)
+{
+    char                      args[512];
+    int                       func_ret;
+    const AVFilter            *buffersrc = avfilter_get_by_name("buffer");
+    const AVFilter            *buffersink = avfilter_get_by_name("buffersink");
+    AVFilterInOut             *outputs = avfilter_inout_alloc();
+    AVFilterInOut             *inputs = avfilter_inout_alloc();
+    AVRational                time_base = input_fctx->streams[stream_id]->time_base;
+    enum AVPixelFormat        pix_fmts[] = { AV_PIX_FMT_YUV420P, AV_PIX_FMT_NONE };
+
+    filter_graph = avfilter_graph_alloc();
+    if (!outputs || !inputs || !filter_graph)
+    {
+        func_ret = AVERROR(ENOMEM);
+        goto end_flag_if;
+    }
+    snprintf(args, sizeof(args),
+            "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d",
+            decoder_ctx->width, decoder_ctx->height, decoder_ctx->pix_fmt,
+            time_base.num, time_base.den,
+            decoder_ctx->sample_aspect_ratio.num, decoder_ctx->sample_aspect_ratio.den);
+    func_ret = avfilter_graph_create_filter(&buffersrc_ctx, buffersrc, "in", args, NULL, filter_graph);
+    if (func_ret < 0)
+    {
+        logging("Cannot create buffer source");
+        goto end_flag_if;
+    }
+    func_ret = avfilter_graph_create_filter(&buffersink_ctx, buffersink, "out", NULL, NULL, filter_graph);
+    if (func_ret < 0)
+    {
+        logging("Cannot create buffer sink");
+        goto end_flag_if;
+    }
+    func_ret = av_opt_set_int_list(buffersink_ctx, "pix_fmts", pix_fmts, AV_PIX_FMT_NONE, AV_OPT_SEARCH_CHILDREN);
+    if (func_ret < 0)
+    {
+        logging("Cannot set output pixel format");
+        goto end_flag_if;
+    }
+
+    outputs->name       = av_strdup("in");
+    outputs->filter_ctx = buffersrc_ctx;
+    outputs->pad_idx    = 0;
+    outputs->next       = NULL;
+
+    inputs->name       = av_strdup("out");
+    inputs->filter_ctx = buffersink_ctx;
+    inputs->pad_idx    = 0;
+    inputs->next       = NULL;
+
+    func_ret = avfilter_graph_parse_ptr(filter_graph, filters_descr, &inputs, &outputs, NULL);
+    if (func_ret < 0)
+    {
+        std::cerr << "could not parse filtergraph: " << filters_descr << std::endl;
+        goto end_flag_if;
+    }
+    func_ret = avfilter_graph_config(filter_graph, NULL);
+    if (func_ret < 0)
+    {
+        std::cerr << "could not configure filtergraph: " << filters_descr << std::endl;
+        goto end_flag_if;
+    }
+end_flag_if:
+    avfilter_inout_free(&inputs);
+    avfilter_inout_free(&outputs);
+    return func_ret;
+}
+
+// frames per bit window
+const uint64_t frame_key = 14;
+uint64_t frame_count;
+// packaging mode: the encoder of variant B (all tiles carry 1), the main output carries 0
+t_stream_params *variant_b = nullptr;
+
+// number of segments listed in a media playlist
+static uint64_t count_segments(const std::string &playlist)
+{
+  std::ifstream file(playlist);
+  std::string   line;
+  uint64_t      res = 0;
+
+  while (std::getline(file, line))
+    res += (line.compare(0, 8, "#EXTINF:") == 0);
+  return res;
+}
+
 int create_fctx(const std::string &filename, AVFormatContext **fctx)
 {
     int func_ret;
@@ -113,7 +226,8 @@ int create_fctx(const std::string &filename, AVFormatContext **fctx)
 
 int encode_video(t_stream_params *t_stream_params, AVFrame *input_frame, AVFormatContext *input_ctx, int stream_id)
 {
-    if (input_frame) input_frame->pict_type = AV_PICTURE_TYPE_NONE;
+    // packaged variants must be cut on window boundaries, so every window starts with a keyframe
+    if (input_frame) input_frame->pict_type = (variant_b && frame_count % frame_key == 0) ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
 
     AVPacket *output_packet = av_packet_alloc();
     AVStream *output_stream = t_stream_params->stream;
@@ -146,6 +260,8 @@ int encode_video(t_stream_params *t_stream_params, AVFrame *input_frame, AVForma
             return -1;
         }
 
+        if (output_packet->flags & AV_PKT_FLAG_KEY)
+          t_stream_params->key_packets++;
         output_packet->stream_index = output_stream->id;
         output_packet->duration = output_stream->time_base.den / output_stream->time_base.num / input_stream->avg_frame_rate.num * input_stream->avg_frame_rate.den;
 
@@ -170,7 +286,11 @@ int encode_video(t_stream_params *t_stream_params, AVFrame *input_frame, AVForma
    
 }
 
-std::vector<t_stream_params> create_encode_stream_params(AVFormatContext *input_fctx, const std::string &out_filename, AVCodecContext *decoder_ctx)
+// with sink_ctx the video encoder takes size, format and frame rate from the filtergraph output,
+// segmented outputs (packaging) get video only, a closed GOP per window and mux_opts for the muxer
+std::vector<t_stream_params> create_encode_stream_params(AVFormatContext *input_fctx, const std::string &out_filename,
+                                                         AVCodecContext *decoder_ctx, AVFilterContext *sink_ctx,
+                                                         bool segmented, AVDictionary **mux_opts)
 {
   std::vector<t_stream_params>  res;
   AVFormatContext               *output_fctx;
@@ -181,7 +301,7 @@ std::vector<t_stream_params> create_encode_stream_params(AVFormatContext *input_
   
   for (size_t i = 0; i < input_fctx->nb_streams; i++)
   {
-    t_stream_params stream_params;
+    t_stream_params stream_params = {};
     AVCodecParameters *pLocalCodecParameters =  NULL;
     AVCodec *pLocalCodec = NULL;
     AVCodecContext *pLocalCodecContext;
@@ -196,6 +316,8 @@ std::vector<t_stream_params> create_encode_stream_params(AVFormatContext *input_
       logging("found not audio or video stream. Index = %d\n SKIPPED", i);
       continue;
     }
+    if (segmented && pLocalCodecParameters->codec_type != AVMEDIA_TYPE_VIDEO)
+      continue;
     out_stream = avformat_new_stream(output_fctx, nullptr);
     out_stream->start_time = input_fctx->streams[i]->start_time;
     stream_params.stream = out_stream;
@@ -255,21 +377,47 @@ std::vector<t_stream_params> create_encode_stream_params(AVFormatContext *input_
     //pLocalCodecContext->rc_max_rate = 2 * 1000 * 1000;
     //pLocalCodecContext->rc_min_rate = 2.5 * 1000 * 1000;
       pLocalCodecContext->time_base = av_inv_q(av_guess_frame_rate(input_fctx, input_fctx->streams[i], NULL));
+      if (sink_ctx)
+      {
+        AVRational frame_rate = av_buffersink_get_frame_rate(sink_ctx);
+
+        pLocalCodecContext->height = av_buffersink_get_h(sink_ctx);
+        pLocalCodecContext->width = av_buffersink_get_w(sink_ctx);
+        pLocalCodecContext->sample_aspect_ratio = av_buffersink_get_sample_aspect_ratio(sink_ctx);
+        pLocalCodecContext->pix_fmt = (AVPixelFormat)av_buffersink_get_format(sink_ctx);
+        if (frame_rate.num > 0 && frame_rate.den > 0)
+          pLocalCodecContext->time_base = av_inv_q(frame_rate);
+      }
       out_stream->time_base = pLocalCodecContext->time_base;
+      if (segmented)
+      {
+        pLocalCodecContext->gop_size = frame_key;
+        pLocalCodecContext->keyint_min = frame_key;
+        av_opt_set(pLocalCodecContext->priv_data, "forced-idr", "1", 0);
+        av_opt_set(pLocalCodecContext->priv_data, "x264-params", "scenecut=0:open-gop=0", 0);
+      }
     }
+    // mp4 and the fMP4 init segment take SPS/PPS from the extradata, not from the packets
+    if (output_fctx->oformat->flags & AVFMT_GLOBALHEADER)
+      pLocalCodecContext->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
     logging("openning the encoder");
     if (avcodec_open2(pLocalCodecContext, pLocalCodec, NULL) < 0)
     {
       logging("failed to open codec");
       goto end_flag_cesp;
     }
+    // the filtergraph may have changed size, aspect or format: describe what the encoder produces
+    if (pLocalCodecParameters->codec_type == AVMEDIA_TYPE_VIDEO &&
+        avcodec_parameters_from_context(out_stream->codecpar, pLocalCodecContext) < 0)
+    {
+      logging("Error in codec-params copy");
+      goto end_flag_cesp;
+    }
     stream_params.fctx = output_fctx;
     
     res.push_back(stream_params);
     logging("\tCodec %s ID %d bit_rate %lld", pLocalCodec->name, pLocalCodec->id, stream_params.codec_params->bit_rate);
   }
-  if (output_fctx->oformat->flags  & AVFMT_GLOBALHEADER)
-    output_fctx->oformat->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
   if (!(output_fctx->oformat->flags & AVFMT_NOFILE))
   {
       func_res = avio_open(&(output_fctx->pb), (const char *)output_fctx->filename, AVIO_FLAG_WRITE);
@@ -281,7 +429,7 @@ std::vector<t_stream_params> create_encode_stream_params(AVFormatContext *input_
           goto end_flag_cesp;
       }
   }
-  func_res = avformat_write_header(output_fctx, nullptr);
+  func_res = avformat_write_header(output_fctx, mux_opts);
   if (func_res < 0) {
     fprintf(stderr, "Error occurred when opening output file\n");
     goto end_flag_cesp;
@@ -290,15 +438,60 @@ end_flag_cesp:
   return res;
 }
 
-uint64_t frame_count;
-bool next_is_one = false;
+std::vector<t_tile> tiles;
 int main(int argc, const char *argv[])
 {
+  int opt;
+
   frame_count = 0;
-  if (argc < 2) {
+  tiles = default_tiles();
+  int placement_request = PLACEMENT_AUTO;
+  t_placement placement;
+  const char *filters_descr = nullptr;
+  const char *package_dir = nullptr;
+  while ((opt = getopt(argc, (char * const *)argv, "t:f:p:N:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'N':
+        if (!parse_placement(optarg, placement_request))
+        {
+          std::cerr << "bad placement, expected a NUMA node, \"auto\" or \"off\"" << std::endl;
+          return -1;
+        }
+        break;
+      case 'p':
+        package_dir = optarg;
+        break;
+      case 'f':
+        filters_descr = optarg;
+        break;
+      case 't':
+        if (!parse_tiles(optarg, tiles))
+        {
+          std::cerr << "bad tile list, expected \"x,y;x,y;...\"" << std::endl;
+          return -1;
+        }
+        break;
+      default:
+        printf("Usage: %s [-t x,y;x,y;...] [-f filtergraph] [-p package dir] [-N node|auto|off] <media file>\n", argv[0]);
+        return -1;
+    }
+  }
+  if (optind >= argc) {
     printf("You need to specify a media file.\n");
     return -1;
   }
+  // before anything allocates frames or starts threads
+  if (apply_placement(placement_request, placement) < 0)
+    return -1;
+  report_placement(placement);
+  if (package_dir && tiles.size() != 1)
+  {
+    std::cerr << "packaging carries one bit per window, use a single tile" << std::endl;
+    return -1;
+  }
+  const char *input_filename = argv[optind];
   std::vector<t_stream_params>  output_streams;
   
   logging("initializing all the containers, codecs and protocols.");
@@ -309,8 +502,8 @@ int main(int argc, const char *argv[])
     return -1;
   }
 
-  logging("opening the input file (%s) and loading format (container) header", argv[1]);
-  if (avformat_open_input(&pFormatContext, argv[1], NULL, NULL) != 0) {
+  logging("opening the input file (%s) and loading format (container) header", input_filename);
+  if (avformat_open_input(&pFormatContext, input_filename, NULL, NULL) != 0) {
     std::cerr << "ERROR could not open the file";
     return -1;
   }
@@ -365,7 +558,7 @@ int main(int argc, const char *argv[])
   }
 
   if (video_stream_index == -1) {
-    std::cerr << "File %s does not contain a video stream!", argv[1];
+    std::cerr << "File %s does not contain a video stream!", input_filename;
     return -1;
   }
 
@@ -389,7 +582,57 @@ int main(int argc, const char *argv[])
   }
 
 
-  output_streams =  create_encode_stream_params(pFormatContext, "lala.mp4", pCodecContext);
+  if (filters_descr && init_filters(filters_descr, pFormatContext, video_stream_index, pCodecContext) < 0)
+    return -1;
+  // the marks are written into what the filtergraph gives out
+  if (buffersink_ctx ? !check_tiles(tiles, av_buffersink_get_w(buffersink_ctx), av_buffersink_get_h(buffersink_ctx))
+                     : !check_tiles(tiles, pCodecContext->width, pCodecContext->height))
+    return -1;
+
+  std::vector<t_stream_params>  variant_b_streams;
+  std::string message = "0110100001100101011011000110110001101111010111110111011101101111011100100110110001100100";
+
+  if (package_dir)
+  {
+    // <dir>/a carries 0 in every window, <dir>/b carries 1, one fMP4 HLS segment per window
+    std::string       dir = package_dir;
+    AVRational        frame_rate = av_guess_frame_rate(pFormatContext, pFormatContext->streams[video_stream_index], NULL);
+    char              hls_time[32];
+
+    if (buffersink_ctx && av_buffersink_get_frame_rate(buffersink_ctx).num > 0)
+      frame_rate = av_buffersink_get_frame_rate(buffersink_ctx);
+    // hls_time below the window length: the muxer cuts at every keyframe, i.e. every window
+    snprintf(hls_time, sizeof(hls_time), "%f", av_q2d(av_inv_q(frame_rate)) * frame_key / 2);
+    for (const char *variant : {"", "/a", "/b"})
+    {
+      if (mkdir((dir + variant).c_str(), 0755) < 0 && errno != EEXIST)
+      {
+        std::cerr << "could not create " << dir + variant << std::endl;
+        return -1;
+      }
+    }
+    for (const char *variant : {"a", "b"})
+    {
+      AVDictionary                  *mux_opts = nullptr;
+      std::vector<t_stream_params>  &streams = (variant[0] == 'a') ? output_streams : variant_b_streams;
+
+      av_dict_set(&mux_opts, "hls_time", hls_time, 0);
+      av_dict_set(&mux_opts, "hls_playlist_type", "vod", 0);
+      av_dict_set(&mux_opts, "hls_segment_type", "fmp4", 0);
+      av_dict_set(&mux_opts, "hls_fmp4_init_filename", "init.mp4", 0);
+      av_dict_set(&mux_opts, "hls_segment_filename", (dir + "/" + variant + "/seg_%05d.m4s").c_str(), 0);
+      av_dict_set(&mux_opts, "hls_flags", "independent_segments", 0);
+      streams = create_encode_stream_params(pFormatContext, dir + "/" + variant + "/index.m3u8",
+                                            pCodecContext, buffersink_ctx, true, &mux_opts);
+      av_dict_free(&mux_opts);
+    }
+    if (output_streams.empty() || variant_b_streams.empty())
+    {  return -1;}
+    variant_b = &variant_b_streams[0];
+    message = "0";
+  }
+  else
+    output_streams =  create_encode_stream_params(pFormatContext, "lala.mp4", pCodecContext, buffersink_ctx, false, nullptr);
   if (output_streams.empty())
   {  return -1;}
 
@@ -407,7 +650,6 @@ int main(int argc, const char *argv[])
   }
 
   int response = 0;
-  std::string message = "0110100001100101011011000110110001101111010111110111011101101111011100100110110001100100";
   int index = 0;
 
   while (av_read_frame(pFormatContext, pPacket) >= 0)
@@ -423,17 +665,63 @@ int main(int argc, const char *argv[])
     }
     av_packet_unref(pPacket);
   }
+  // frames held back by the decoder (reordering) and then by the filtergraph (fps, tpad, ...)
+  // come out after EOF
+  for (int i = 0; response >= 0 && i < output_streams.size(); i++)
+  {
+    if (output_streams[i].media_type != AVMEDIA_TYPE_VIDEO)
+      continue;
+    response = decode_packet(nullptr, pCodecContext, pFrame, &(output_streams[i]), pFormatContext, video_stream_index, message, index);
+    if (response >= 0 && filter_graph)
+    {
+      response = av_buffersrc_add_frame(buffersrc_ctx, NULL);
+      if (response >= 0)
+        response = drain_filters(&(output_streams[i]), pFormatContext, video_stream_index, message, index);
+    }
+    if (response < 0)
+      std::cerr << "failed to flush the decoder" << (filter_graph ? " and the filtergraph" : "") << std::endl;
+    break;
+  }
+  // the encoders still hold their lookahead
+  for (int i = 0; i < output_streams.size(); i++)
+    if (output_streams[i].media_type == AVMEDIA_TYPE_VIDEO)
+      encode_video(&(output_streams[i]), nullptr, pFormatContext, video_stream_index);
+  if (variant_b)
+    encode_video(variant_b, nullptr, pFormatContext, video_stream_index);
   response =  av_write_trailer(output_streams[0].fctx);
   if (response == AVERROR(EAGAIN) || response == AVERROR_EOF) {
       std::cerr << "something goes wrong with writing in file";
   }
   avio_closep(&(output_streams[0].fctx->pb));
+  if (variant_b)
+  {
+    if (av_write_trailer(variant_b->fctx) < 0)
+      std::cerr << "something goes wrong with writing in file";
+    avio_closep(&(variant_b->fctx->pb));
+
+    // the assembler swaps whole segments, so both variants must hold exactly one keyframe and one
+    // segment per window; this depends on the encoder and muxer options, check what was written
+    uint64_t windows = (frame_count + frame_key - 1) / frame_key;
+    uint64_t segments_a = count_segments(std::string(package_dir) + "/a/index.m3u8");
+    uint64_t segments_b = count_segments(std::string(package_dir) + "/b/index.m3u8");
+
+    if (output_streams[0].key_packets != windows || variant_b->key_packets != windows
+        || segments_a != windows || segments_b != windows)
+    {
+      std::cerr << "package is not cut on the windows: " << windows << " windows, keyframes "
+        << output_streams[0].key_packets << "/" << variant_b->key_packets << ", segments "
+        << segments_a << "/" << segments_b << " (a/b)" << std::endl;
+      return -1;
+    }
+    std::cout << windows << " window segments written to " << package_dir << std::endl;
+  }
   logging("releasing all the resources");
 
   avformat_close_input(&pFormatContext);
   av_packet_free(&pPacket);
   av_frame_free(&pFrame);
   avcodec_free_context(&pCodecContext);
+  avfilter_graph_free(&filter_graph);
   return 0;
 }
 
@@ -454,7 +742,6 @@ static int decode_packet(AVPacket *pPacket, AVCodecContext *pCodecContext,
                          AVFormatContext *input_fctx, int stream_id,
                          const std::string message, int &mess_index)
 {
-  uint64_t first_skipped_frames = 10;
   int response = avcodec_send_packet(pCodecContext, pPacket);
 
   if (response < 0) {
@@ -474,44 +761,109 @@ static int decode_packet(AVPacket *pPacket, AVCodecContext *pCodecContext,
 
 
     if (response >= 0) {
-
-      if (pFrame->format != AV_PIX_FMT_YUV420P)
+      if (!filter_graph)
       {
-        logging("Warning: the generated file may not be a grayscale image, but could e.g. be just the R component if the video format is RGB");
+        response = mark_and_encode_frame(pFrame, stream_params, input_fctx, stream_id, message, mess_index);
+        if (response < 0)
+          return response;
+        continue;
       }
-      uint64_t frame_key = 14;
-      uint64_t half_key = frame_key / 2;
-      uint64_t end_key = frame_key - 1;
-      uint64_t frame_module = frame_count % frame_key;
-
-      if (frame_count == first_skipped_frames)
-      {
-        if (message[0] == '1')
-          next_is_one = true;
-        else
-          next_is_one = false;
+      response = av_buffersrc_add_frame_flags(buffersrc_ctx, pFrame, AV_BUFFERSRC_FLAG_KEEP_REF);
+      if (response < 0) {
+        logging("Error while feeding the filtergraph: %d", response);
+        return response;
       }
-      if (frame_module >= half_key)
-      {
-        bool is_one;
+      response = drain_filters(stream_params, input_fctx, stream_id, message, mess_index);
+      if (response < 0)
+        return response;
+    }
+  }
+  return 0;
+}
 
-        if (message[mess_index] == '1') { is_one = true; }
-        else                            { is_one = false; }
+static int drain_filters(t_stream_params *stream_params, AVFormatContext *input_fctx, int stream_id,
+                         const std::string &message, int &mess_index)
+{
+  int     response = 0;
+  AVFrame *filt_frame = av_frame_alloc();
 
-        set_watermark(pFrame->data[0], pFrame->data[1], pFrame->data[2], pFrame->linesize[0], pFrame->linesize[1], pFrame->linesize[2], pFrame->width, pFrame->height, is_one);
-        
-        if (frame_module == end_key) { std::cout << message[mess_index]; mess_index++; }
-        if (message.length() <= mess_index) mess_index = 0;
-        if (message[mess_index] == '1') next_is_one = true;
-        else                            next_is_one = false;
-      }
-      else{
-        set_watermark(pFrame->data[0], pFrame->data[1], pFrame->data[2], pFrame->linesize[0], pFrame->linesize[1], pFrame->linesize[2], pFrame->width, pFrame->height, !next_is_one);
-      }
-      encode_video(stream_params, pFrame, input_fctx, stream_id);
-      frame_count++;
+  if (!filt_frame)
+    return AVERROR(ENOMEM);
+  while (response >= 0 && av_buffersink_get_frame(buffersink_ctx, filt_frame) >= 0)
+  {
+    // encode_video expects timestamps in the input stream time base
+    if (filt_frame->pts != AV_NOPTS_VALUE)
+      filt_frame->pts = av_rescale_q(filt_frame->pts, av_buffersink_get_time_base(buffersink_ctx),
+                                     input_fctx->streams[stream_id]->time_base);
+    response = mark_and_encode_frame(filt_frame, stream_params, input_fctx, stream_id, message, mess_index);
+    av_frame_unref(filt_frame);
+  }
+  av_frame_free(&filt_frame);
+  return response;
+}
+
+// tile k carries bit (mess_index + k); the first half of the window holds the inverted bit
+static int mark_frame(AVFrame *pFrame, const std::string &message, int mess_index)
+{
+  uint64_t half_key = frame_key / 2;
+  uint64_t frame_module = frame_count % frame_key;
+
+  for (size_t k = 0; k < tiles.size(); k++)
+  {
+    bool is_one = (message[(mess_index + k) % message.length()] == '1');
+
+    if (frame_module < half_key)
+      is_one = !is_one;
+    if (!set_watermark(pFrame->data[0], pFrame->data[1], pFrame->data[2], pFrame->linesize[0], pFrame->linesize[1], pFrame->linesize[2], pFrame->width, pFrame->height, tiles[k], is_one))
+    {
+      std::cerr << "frame " << frame_count << " is " << pFrame->width << "x" << pFrame->height
+        << ", tile " << k << " does not fit into it" << std::endl;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int mark_and_encode_frame(AVFrame *pFrame, t_stream_params *stream_params,
+                                 AVFormatContext *input_fctx, int stream_id,
+                                 const std::string &message, int &mess_index)
+{
+  if (pFrame->format != AV_PIX_FMT_YUV420P)
+  {
+    logging("Warning: the generated file may not be a grayscale image, but could e.g. be just the R component if the video format is RGB");
+  }
+  uint64_t end_key = frame_key - 1;
+  uint64_t frame_module = frame_count % frame_key;
+
+  if (variant_b)
+  {
+    // the same frame with the other bit value, on its own copy of the planes
+    AVFrame *frame_b = av_frame_clone(pFrame);
+
+    if (!frame_b || av_frame_make_writable(frame_b) < 0)
+    {
+      av_frame_free(&frame_b);
+      return AVERROR(ENOMEM);
+    }
+    if (mark_frame(frame_b, "1", 0) < 0)
+    {
+      av_frame_free(&frame_b);
+      return -1;
     }
+    encode_video(variant_b, frame_b, input_fctx, stream_id);
+    av_frame_free(&frame_b);
+  }
+  if (mark_frame(pFrame, message, mess_index) < 0)
+    return -1;
+  if (frame_module == end_key)
+  {
+    if (!variant_b)
+      for (size_t k = 0; k < tiles.size(); k++)
+        std::cout << message[(mess_index + k) % message.length()];
+    mess_index = (mess_index + tiles.size()) % message.length();
   }
+  encode_video(stream_params, pFrame, input_fctx, stream_id);
+  frame_count++;
   return 0;
 }
 
@@ -0,0 +1,404 @@
+/*
+ * Matches payloads read by get_mark against a catalog of assigned payloads.
+ *
+ * Catalog file: one "<recipient id> <payload bits>" pair per line, '#' starts a comment.
+ * Query: the bit string printed by get_mark. Any character other than '0'/'1' is an
+ * erased bit. A query longer than the payload is folded by majority vote over its
+ * repetitions (the embedder repeats the payload), ties become erased bits.
+ * A clip that does not start at frame 0 gives a rotated query: with -o the query starts at
+ * that payload bit, otherwise every rotation is tried and the best one of each recipient is
+ * reported with its offset. Trying all rotations also multiplies the chance of a false match
+ * by the payload length, so -d should be kept low for short queries.
+ * A query needs at least d + 1 known bits, with fewer any payload would be within distance d.
+ *
+ * Payloads are bit-packed into 64-bit words and compared with popcount. For lookups
+ * the payload is split into m chunks, each chunk has a table of entry numbers sorted by
+ * the chunk value (multi-index hashing, the value itself is read from the packed bits):
+ * two payloads within distance d agree exactly on at least one of d + 1 chunks, so only
+ * entries sharing a chunk with the query have to be verified.
+ * Erased bits are filled in: the d + 1 chunks with the fewest erasures are probed with every
+ * value of their erased bits, which keeps the lookup exact. Only when one of them has more
+ * than MAX_FILL_ERASURES erased bits is the catalog scanned linearly instead.
+ */
+#include <unistd.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+
+#define DEBUG 0
+// erased bits of one chunk that are filled in by probing, 2^n lookups
+#define MAX_FILL_ERASURES 8
+
+typedef struct {
+  size_t                                nbits;
+  size_t                                nwords;
+  std::vector<std::string>              ids;
+  std::vector<uint64_t>                 bits;         // nwords per entry
+  std::vector<size_t>                   chunk_start;  // nchunks + 1 bit offsets
+  std::vector<std::vector<uint32_t>>    chunk_index;  // entries sorted by chunk value
+}                                       t_catalog;
+
+typedef struct {
+  std::vector<uint64_t> bits;
+  std::vector<uint64_t> mask;   // 1 for every known bit
+}                       t_query;
+
+typedef struct {
+  uint32_t      entry;
+  unsigned int  distance;
+  size_t        offset;   // payload bit the query starts at
+}               t_match;
+
+// print out the steps and errors
+static void logging(const char *fmt, ...);
+
+// read len (<= 64) bits starting at bit start
+static uint64_t get_bits(const uint64_t *words, size_t start, size_t len)
+{
+  size_t    word = start / 64, shift = start % 64;
+  uint64_t  res = words[word] >> shift;
+
+  if (shift + len > 64)
+    res |= words[word + 1] << (64 - shift);
+  if (len < 64)
+    res &= (UINT64_C(1) << len) - 1;
+  return res;
+}
+
+static bool pack_bits(const std::string &s, size_t nwords, uint64_t *out)
+{
+  std::fill(out, out + nwords, 0);
+  for (size_t i = 0; i < s.length(); i++)
+  {
+    if (s[i] == '1')
+      out[i / 64] |= UINT64_C(1) << (i % 64);
+    else if (s[i] != '0')
+      return false;
+  }
+  return true;
+}
+
+static int load_catalog(const char *filename, t_catalog &catalog)
+{
+  std::ifstream file(filename);
+  std::string   line;
+  size_t        line_no = 0;
+
+  if (!file)
+  {
+    std::cerr << "could not open catalog " << filename << std::endl;
+    return -1;
+  }
+  catalog.nbits = 0;
+  while (std::getline(file, line))
+  {
+    std::istringstream  ss(line);
+    std::string         id, payload;
+
+    line_no++;
+    if (!(ss >> id) || id[0] == '#')
+      continue;
+    if (!(ss >> payload))
+    {
+      std::cerr << filename << ":" << line_no << ": missing payload" << std::endl;
+      return -1;
+    }
+    if (catalog.nbits == 0)
+    {
+      catalog.nbits = payload.length();
+      catalog.nwords = (catalog.nbits + 63) / 64;
+    }
+    if (payload.length() != catalog.nbits)
+    {
+      std::cerr << filename << ":" << line_no << ": payload length " << payload.length()
+        << " differs from " << catalog.nbits << std::endl;
+      return -1;
+    }
+    catalog.bits.resize(catalog.bits.size() + catalog.nwords);
+    if (!pack_bits(payload, catalog.nwords, &catalog.bits[catalog.bits.size() - catalog.nwords]))
+    {
+      std::cerr << filename << ":" << line_no << ": payload is not a bit string" << std::endl;
+      return -1;
+    }
+    catalog.ids.push_back(id);
+  }
+  if (catalog.ids.empty())
+  {
+    std::cerr << "catalog " << filename << " is empty" << std::endl;
+    return -1;
+  }
+  logging("loaded %zu payloads of %zu bits", catalog.ids.size(), catalog.nbits);
+  return 0;
+}
+
+static uint64_t chunk_value(const t_catalog &catalog, uint32_t entry, size_t chunk)
+{
+  size_t start = catalog.chunk_start[chunk];
+
+  return get_bits(&catalog.bits[entry * catalog.nwords], start, catalog.chunk_start[chunk + 1] - start);
+}
+
+static void build_index(t_catalog &catalog, size_t nchunks)
+{
+  size_t n = catalog.ids.size();
+
+  catalog.chunk_start.clear();
+  for (size_t c = 0; c <= nchunks; c++)
+    catalog.chunk_start.push_back(c * catalog.nbits / nchunks);
+  catalog.chunk_index.assign(nchunks, std::vector<uint32_t>(n));
+  for (size_t c = 0; c < nchunks; c++)
+  {
+    std::vector<uint32_t> &table = catalog.chunk_index[c];
+
+    for (uint32_t e = 0; e < n; e++)
+      table[e] = e;
+    std::sort(table.begin(), table.end(), [&catalog, c](uint32_t a, uint32_t b)
+      {
+        uint64_t ka = chunk_value(catalog, a, c), kb = chunk_value(catalog, b, c);
+        return ka < kb || (ka == kb && a < b);
+      });
+  }
+  logging("built %zu chunk tables", nchunks);
+}
+
+// chunks: enough for d + 1 chunks, and about log2(catalog size) bits per chunk
+static size_t choose_chunks(size_t nbits, size_t entries, unsigned int max_distance)
+{
+  size_t key_bits = 1, nchunks;
+
+  while ((UINT64_C(1) << key_bits) < entries && key_bits < 63)
+    key_bits++;
+  nchunks = std::max<size_t>(max_distance + 1, nbits / key_bits);
+  nchunks = std::max<size_t>(nchunks, (nbits + 63) / 64);
+  return std::min(nchunks, nbits);
+}
+
+// query bit j is payload bit (offset + j) % nbits, returns the number of known bits
+static size_t parse_query(const std::string &s, size_t nbits, size_t offset, t_query &query)
+{
+  size_t nwords = (nbits + 63) / 64;
+  size_t known = 0;
+
+  query.bits.assign(nwords, 0);
+  query.mask.assign(nwords, 0);
+  for (size_t i = 0; i < nbits; i++)
+  {
+    int votes = 0;
+
+    for (size_t j = (i + nbits - offset % nbits) % nbits; j < s.length(); j += nbits)
+    {
+      if (s[j] == '1')      votes++;
+      else if (s[j] == '0') votes--;
+    }
+    if (votes == 0)
+      continue;
+    known++;
+    query.mask[i / 64] |= UINT64_C(1) << (i % 64);
+    if (votes > 0)
+      query.bits[i / 64] |= UINT64_C(1) << (i % 64);
+  }
+  return known;
+}
+
+static unsigned int distance(const uint64_t *entry, const t_query &query, size_t nwords)
+{
+  unsigned int res = 0;
+
+  for (size_t w = 0; w < nwords; w++)
+    res += __builtin_popcountll((entry[w] ^ query.bits[w]) & query.mask[w]);
+  return res;
+}
+
+static void linear_scan(const t_catalog &catalog, const t_query &query, unsigned int max_distance,
+                        std::vector<t_match> &matches)
+{
+  for (uint32_t e = 0; e < catalog.ids.size(); e++)
+  {
+    unsigned int dist = distance(&catalog.bits[e * catalog.nwords], query, catalog.nwords);
+
+    if (dist <= max_distance)
+      matches.push_back(t_match{e, dist, 0});
+  }
+}
+
+static void probe_chunk(const t_catalog &catalog, size_t c, uint64_t key, std::vector<uint32_t> &candidates)
+{
+  const std::vector<uint32_t> &table = catalog.chunk_index[c];
+  auto                        it = std::lower_bound(table.begin(), table.end(), key,
+    [&catalog, c](uint32_t e, uint64_t k) { return chunk_value(catalog, e, c) < k; });
+
+  for (; it != table.end() && chunk_value(catalog, *it, c) == key; it++)
+    candidates.push_back(*it);
+}
+
+// returns false when the query has too many erasures for the index to be exact
+static bool index_lookup(const t_catalog &catalog, const t_query &query, unsigned int max_distance,
+                         std::vector<t_match> &matches)
+{
+  std::vector<std::pair<unsigned int, size_t>>  erased;   // (erased bits, chunk)
+  std::vector<uint32_t>                         candidates;
+
+  for (size_t c = 0; c < catalog.chunk_index.size(); c++)
+  {
+    size_t start = catalog.chunk_start[c];
+    size_t len = catalog.chunk_start[c + 1] - start;
+
+    erased.push_back(std::make_pair(len - __builtin_popcountll(get_bits(query.mask.data(), start, len)), c));
+  }
+  // at most d chunks hold a wrong known bit, so one of any d + 1 chunks matches on all of them
+  std::sort(erased.begin(), erased.end());
+  if (erased.size() <= max_distance || erased[max_distance].first > MAX_FILL_ERASURES)
+    return false;
+  for (size_t i = 0; i <= max_distance; i++)
+  {
+    size_t              c = erased[i].second;
+    size_t              start = catalog.chunk_start[c];
+    size_t              len = catalog.chunk_start[c + 1] - start;
+    uint64_t            mask = get_bits(query.mask.data(), start, len);
+    uint64_t            key = get_bits(query.bits.data(), start, len) & mask;
+    std::vector<size_t> holes;
+
+    for (size_t b = 0; b < len; b++)
+      if (!(mask >> b & 1))
+        holes.push_back(b);
+    for (uint64_t fill = 0; fill < (UINT64_C(1) << holes.size()); fill++)
+    {
+      uint64_t filled = key;
+
+      for (size_t h = 0; h < holes.size(); h++)
+        if (fill >> h & 1)
+          filled |= UINT64_C(1) << holes[h];
+      probe_chunk(catalog, c, filled, candidates);
+    }
+  }
+  std::sort(candidates.begin(), candidates.end());
+  candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+  for (uint32_t e : candidates)
+  {
+    unsigned int dist = distance(&catalog.bits[e * catalog.nwords], query, catalog.nwords);
+
+    if (dist <= max_distance)
+      matches.push_back(t_match{e, dist, 0});
+  }
+  return true;
+}
+
+// offset < 0: try every rotation of the query
+static void match_query(const t_catalog &catalog, const std::string &s, size_t query_no,
+                        unsigned int max_distance, size_t max_results, long offset)
+{
+  t_query               query;
+  std::vector<t_match>  matches;
+  size_t                end = s.find_last_not_of(" \t\r\n");
+  size_t                first = (offset < 0) ? 0 : offset, last = (offset < 0) ? catalog.nbits : first + 1;
+
+  if (end == std::string::npos)
+    return;
+  for (size_t rot = first; rot < last; rot++)
+  {
+    size_t known = parse_query(s.substr(0, end + 1), catalog.nbits, rot, query);
+    size_t found = matches.size();
+
+    if (known <= max_distance)
+    {
+      std::cerr << "query " << query_no << ": " << known << " known bits, at least "
+        << max_distance + 1 << " are needed" << std::endl;
+      std::cout << query_no << " - - -" << std::endl;
+      return;
+    }
+    if (!index_lookup(catalog, query, max_distance, matches))
+    {
+      logging("query %zu: too many erased chunks, scanning the catalog", query_no);
+      linear_scan(catalog, query, max_distance, matches);
+    }
+    for (size_t i = found; i < matches.size(); i++)
+      matches[i].offset = rot;
+  }
+  // best rotation of every recipient
+  std::sort(matches.begin(), matches.end(), [](const t_match &a, const t_match &b)
+    { return a.entry < b.entry || (a.entry == b.entry && a.distance < b.distance); });
+  matches.erase(std::unique(matches.begin(), matches.end(), [](const t_match &a, const t_match &b)
+    { return a.entry == b.entry; }), matches.end());
+  std::sort(matches.begin(), matches.end(), [](const t_match &a, const t_match &b)
+    { return a.distance < b.distance || (a.distance == b.distance && a.entry < b.entry); });
+  if (matches.size() > max_results)
+    matches.resize(max_results);
+  if (matches.empty())
+    std::cout << query_no << " - - -" << std::endl;
+  for (const t_match &m : matches)
+    std::cout << query_no << " " << catalog.ids[m.entry] << " " << m.distance << " " << m.offset << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+  t_catalog     catalog;
+  unsigned int  max_distance = 4;
+  size_t        nchunks = 0;
+  size_t        max_results = 10;
+  long          offset = -1;
+  int           opt;
+
+  while ((opt = getopt(argc, argv, "d:m:k:o:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'd': max_distance = strtoul(optarg, NULL, 10); break;
+      case 'm': nchunks = strtoul(optarg, NULL, 10); break;
+      case 'k': max_results = strtoul(optarg, NULL, 10); break;
+      case 'o': offset = strtol(optarg, NULL, 10); break;
+      default:
+        printf("Usage: %s [-d max distance] [-m index chunks] [-k max results] [-o query offset] <catalog> [query ...]\n", argv[0]);
+        return -1;
+    }
+  }
+  if (optind >= argc) {
+    printf("You need to specify a catalog file.\n");
+    return -1;
+  }
+  if (load_catalog(argv[optind], catalog) < 0)
+    return -1;
+  if (offset >= (long)catalog.nbits)
+  {
+    std::cerr << "offset must be below the payload length " << catalog.nbits << std::endl;
+    return -1;
+  }
+  if (nchunks == 0)
+    nchunks = choose_chunks(catalog.nbits, catalog.ids.size(), max_distance);
+  nchunks = std::min(std::max(nchunks, (catalog.nbits + 63) / 64), catalog.nbits);
+  build_index(catalog, nchunks);
+
+  size_t query_no = 0;
+  if (optind + 1 < argc)
+  {
+    for (int i = optind + 1; i < argc; i++)
+      match_query(catalog, argv[i], query_no++, max_distance, max_results, offset);
+  }
+  else
+  {
+    std::string line;
+
+    while (std::getline(std::cin, line))
+      match_query(catalog, line, query_no++, max_distance, max_results, offset);
+  }
+  return 0;
+}
+
+static void logging(const char *fmt, ...)
+{
+  #if DEBUG == 1
+    va_list args;
+    fprintf( stderr, "LOG: " );
+    va_start( args, fmt );
+    vfprintf( stderr, fmt, args );
+    va_end( args );
+    fprintf( stderr, "\n" );
+  #endif
+}
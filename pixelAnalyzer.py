@@ -1,23 +1,116 @@
-import matplotlib.pyplot as plt
+import mmap
+import struct
 import sys
 
-if len(sys.argv) != 2:
+# header of the get_mark -T trace, see t_trace_header in find_watermark.cpp
+TRACE_HEADER = struct.Struct("=4sHHIiiI")
+TRACE_RECORD_HEAD = 24
+MAX_PLOT_POINTS = 20000
+
+
+def usage():
 	print("Usage: python3 pixelAnalyzer.py \"<ints separated by commas>\"")
+	print("       python3 pixelAnalyzer.py --trace <trace file> [--plot [tile] [from frame] [to frame]]")
 	sys.exit(0)
 
-s = list(map(int, (sys.argv[1].split(','))))
-s = [None, *s]
-#s = [None, 3881, 3881, 3881, 4029, 4085, 4119, 4155, 1626, 1504, 1480, 1480, 1480, 1480, 1480, 1480, 1480, 1480, 1480, 1556, 1556, 1556, 3640, 3648, 3552, 3552, 3552, 3552, 3552, 1631, 1631, 1619, 1619, 1619, 1619, 1615, 4162, 4162, 4162, 5625, 5625, 5625, 5625, 5507, 5539, 5539, 5539, 5539, 5539, 5539, 0, 0, 0, 0, 0, 0, 32, 0, 0, 160, 160, 208, 208, 260, 4707, 4983, 4951, 5181, 5181, 5181, 5181, 5181, 5065, 5197, 5189, 5157, 4969, 5113, 684, 640, 656, 528, 616, 428, 376, 5041, 4893, 4803, 4933, 4933, 4957, 4827, 512, 448, 388, 460, 0, 0, 0, 5625, 5625, 5625, 5625, 5625, 5625, 5625, 0, 0, 0, 0, 0, 0, 0, 5625, 5625, 5625, 5625, 5625, 5625]
-add_grid = []
 
-for i in range(0, int((len(s) / 14) + 1)):
-    add_grid.append(i * 14)
-for i in add_grid:
-    plt.plot([ i, i ] , [-100, 10000], color="red")
-    plt.plot([ i - 6.5, i - 6.5 ], [0, 9800], color="green")
-plt.xlabel("кадры")
-plt.ylabel("маркированные пиксели")
-plt.plot(s)
-plt.show()
+def plot_marks(s, frame_key=14, first_frame=0, step=1):
+    import matplotlib.pyplot as plt
+
+    x = [first_frame + i * step for i in range(len(s))]
+    if step == 1 and len(s) <= 2000:
+        for i in range(first_frame - first_frame % frame_key, first_frame + len(s) + 1, frame_key):
+            plt.plot([ i, i ] , [-100, 10000], color="red")
+            plt.plot([ i - frame_key / 2 + 0.5, i - frame_key / 2 + 0.5 ], [0, 9800], color="green")
+    plt.xlabel("кадры")
+    plt.ylabel("маркированные пиксели")
+    plt.plot(x, s)
+    plt.show()
+
+
+def open_trace(filename):
+    f = open(filename, "rb")
+    m = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+    magic, version, ntiles, frame_key, tb_num, tb_den, record_size = TRACE_HEADER.unpack_from(m, 0)
+    if magic != b"WMTR" or version != 1 or record_size != TRACE_RECORD_HEAD + 4 * ntiles:
+        print("%s is not a mark trace" % filename)
+        sys.exit(1)
+    words = memoryview(m)[TRACE_HEADER.size:].cast("I")
+    rec_words = record_size // 4
+    header = {"ntiles": ntiles, "frame_key": frame_key, "time_base": (tb_num, tb_den),
+              "rec_words": rec_words, "frames": len(words) // rec_words}
+    return header, words
+
+
+# column of the trace, every record contributes one u32 word
+def trace_column(header, words, word, first=0, last=None, step=1):
+    if last is None or last > header["frames"]:
+        last = header["frames"]
+    rec_words = header["rec_words"]
+    return words[first * rec_words + word:last * rec_words:rec_words * step]
+
+
+def tile_column(header, words, tile, first=0, last=None, step=1):
+    return trace_column(header, words, TRACE_RECORD_HEAD // 4 + tile, first, last, step)
 
 
+# same decision as decode_packet in find_watermark.cpp
+def decode_bits(header, words):
+    frame_key = header["frame_key"]
+    half_key = frame_key // 2
+    key_0_1 = frame_key // 10 + (1 if frame_key % 10 >= 5 else 0)
+    tiles = [tile_column(header, words, k) for k in range(header["ntiles"])]
+    bits = []
+    for start in range(0, header["frames"] - frame_key + 1, frame_key):
+        for counts in tiles:
+            first = sum(counts[start + key_0_1:start + half_key - key_0_1]) // (half_key - key_0_1)
+            second = sum(counts[start + half_key + key_0_1:start + frame_key - key_0_1]) // (half_key - key_0_1)
+            bits.append("0" if first > second else "1")
+    return "".join(bits)
+
+
+def summarize(header, words):
+    frames = header["frames"]
+    tb_num, tb_den = header["time_base"]
+    print("frames: %d, tiles: %d, window: %d frames" % (frames, header["ntiles"], header["frame_key"]))
+    if frames == 0:
+        return
+    pts_lo, pts_hi = trace_column(header, words, 2), trace_column(header, words, 3)
+    first_pts = struct.unpack("=q", struct.pack("=II", pts_lo[0], pts_hi[0]))[0]
+    last_pts = struct.unpack("=q", struct.pack("=II", pts_lo[-1], pts_hi[-1]))[0]
+    if tb_den:
+        print("pts: %d .. %d (%.3f s)" % (first_pts, last_pts, (last_pts - first_pts) * tb_num / tb_den))
+    for k in range(header["ntiles"]):
+        counts = tile_column(header, words, k)
+        print("tile %d: min %d, max %d, mean %.1f" % (k, min(counts), max(counts), sum(counts) / frames))
+    print("bits: %s" % decode_bits(header, words))
+
+
+def plot_trace(header, words, tile=0, first=0, last=None):
+    if last is None or last > header["frames"]:
+        last = header["frames"]
+    step = max(1, (last - first) // MAX_PLOT_POINTS)
+    plot_marks(list(tile_column(header, words, tile, first, last, step)), header["frame_key"], first, step)
+
+
+if len(sys.argv) < 2:
+	usage()
+
+if sys.argv[1] == "--trace":
+    if len(sys.argv) < 3:
+        usage()
+    header, words = open_trace(sys.argv[2])
+    if len(sys.argv) > 3 and sys.argv[3] == "--plot":
+        args = list(map(int, sys.argv[4:7]))
+        plot_trace(header, words, *args)
+    else:
+        summarize(header, words)
+    sys.exit(0)
+
+if len(sys.argv) != 2:
+	usage()
+
+s = list(map(int, filter(None, (x.strip() for x in sys.argv[1].split(',')))))
+s = [None, *s]
+#s = [None, 3881, 3881, 3881, 4029, 4085, 4119, 4155, 1626, 1504, 1480, 1480, 1480, 1480, 1480, 1480, 1480, 1480, 1480, 1556, 1556, 1556, 3640, 3648, 3552, 3552, 3552, 3552, 3552, 1631, 1631, 1619, 1619, 1619, 1619, 1615, 4162, 4162, 4162, 5625, 5625, 5625, 5625, 5507, 5539, 5539, 5539, 5539, 5539, 5539, 0, 0, 0, 0, 0, 0, 32, 0, 0, 160, 160, 208, 208, 260, 4707, 4983, 4951, 5181, 5181, 5181, 5181, 5181, 5065, 5197, 5189, 5157, 4969, 5113, 684, 640, 656, 528, 616, 428, 376, 5041, 4893, 4803, 4933, 4933, 4957, 4827, 512, 448, 388, 460, 0, 0, 0, 5625, 5625, 5625, 5625, 5625, 5625, 5625, 0, 0, 0, 0, 0, 0, 0, 5625, 5625, 5625, 5625, 5625, 5625]
+plot_marks(s)
@@ -0,0 +1,107 @@
+/*
+ * Watermark tile geometry shared by the embedder (set_mark) and the detector (get_mark).
+ *
+ * Every tile carries its own bit stream: in a window of frame_key frames tile k
+ * carries bit (first_bit + k) of the message, so K tiles move K bits per window.
+ */
+#ifndef TILES_H
+# define TILES_H
+
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <iostream>
+
+// side of the square written by set_mark
+#define WATERMARK_SIZE        100
+// side of the square read back by get_mark (bottom-right part of the tile)
+#define WATERMARK_DETECT_SIZE 75
+
+// Top-left corner of a tile. Negative values are counted from the right/bottom
+// frame edge, so {-WATERMARK_SIZE, -WATERMARK_SIZE} is the bottom-right tile.
+typedef struct {
+  int x;
+  int y;
+}   t_tile;
+
+static std::vector<t_tile> default_tiles()
+{
+  return std::vector<t_tile>(1, t_tile{-WATERMARK_SIZE, -WATERMARK_SIZE});
+}
+
+// parse "x,y;x,y;..." into tiles, returns false on a malformed spec
+static bool parse_tiles(const std::string &spec, std::vector<t_tile> &tiles)
+{
+  std::vector<t_tile> res;
+  size_t              pos = 0;
+
+  while (pos < spec.length())
+  {
+    size_t      end = spec.find(';', pos);
+    std::string item = spec.substr(pos, end == std::string::npos ? std::string::npos : end - pos);
+    const char  *s = item.c_str();
+    char        *endp;
+    t_tile      tile;
+
+    tile.x = strtol(s, &endp, 10);
+    if (endp == s || *endp != ',')
+      return false;
+    s = endp + 1;
+    tile.y = strtol(s, &endp, 10);
+    if (endp == s || *endp != '\0')
+      return false;
+    res.push_back(tile);
+    if (end == std::string::npos)
+      break;
+    pos = end + 1;
+  }
+  if (res.empty())
+    return false;
+  tiles = res;
+  return true;
+}
+
+// absolute top-left corner of the tile, rounded down to even coordinates so that tiles never
+// share a 4:2:0 chroma sample; false if the tile does not fit into the frame
+static bool resolve_tile(const t_tile &tile, int xsize, int ysize, unsigned int &x0, unsigned int &y0)
+{
+  int x = tile.x < 0 ? xsize + tile.x : tile.x;
+  int y = tile.y < 0 ? ysize + tile.y : tile.y;
+
+  x &= ~1;
+  y &= ~1;
+  if (x < 0 || y < 0 || x + WATERMARK_SIZE > xsize || y + WATERMARK_SIZE > ysize)
+    return false;
+  x0 = x;
+  y0 = y;
+  return true;
+}
+
+// every tile must fit into the frame and no two tiles may overlap, the offending tile is named
+static bool check_tiles(const std::vector<t_tile> &tiles, int xsize, int ysize)
+{
+  std::vector<unsigned int> x0(tiles.size()), y0(tiles.size());
+
+  for (size_t t = 0; t < tiles.size(); t++)
+  {
+    if (!resolve_tile(tiles[t], xsize, ysize, x0[t], y0[t]))
+    {
+      std::cerr << "tile " << t << " (" << tiles[t].x << "," << tiles[t].y << ") does not fit into the "
+        << xsize << "x" << ysize << " frame" << std::endl;
+      return false;
+    }
+    for (size_t u = 0; u < t; u++)
+    {
+      if (x0[t] < x0[u] + WATERMARK_SIZE && x0[u] < x0[t] + WATERMARK_SIZE &&
+          y0[t] < y0[u] + WATERMARK_SIZE && y0[u] < y0[t] + WATERMARK_SIZE)
+      {
+        std::cerr << "tiles " << u << " (" << tiles[u].x << "," << tiles[u].y << ") and " << t
+          << " (" << tiles[t].x << "," << tiles[t].y << ") overlap" << std::endl;
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+#endif
@@ -0,0 +1,265 @@
+/*
+ * NUMA placement shared by the embedder (set_mark) and the detector (get_mark).
+ *
+ * The node topology is read from sysfs. A job is pinned to the CPUs of one node and its
+ * memory policy prefers that node, before any codec or worker thread exists: threads
+ * inherit the affinity, libavcodec and x264 size their thread pools from it, and frame
+ * buffers are first touched on the node.
+ *
+ * Only the cpus of the affinity the job was started with (taskset, cpusets) are used, nodes
+ * without any of them are skipped.
+ *
+ * Concurrent jobs are spread over the nodes with one lock file per (node, slot) in
+ * PLACEMENT_LOCK_DIR: an automatic job takes the lowest free slot on any node, so the nodes
+ * fill up level by level, a job with a requested node takes the lowest free slot on it so
+ * that automatic jobs see it. The lock is held until the process exits.
+ * A job that cannot be pinned in automatic mode runs unplaced, as without placement.
+ */
+#ifndef TOPOLOGY_H
+# define TOPOLOGY_H
+
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+
+#define PLACEMENT_AUTO      -2
+#define PLACEMENT_OFF       -1
+#define PLACEMENT_LOCK_DIR  "/tmp/watermark-numa"
+#define PLACEMENT_MAX_SLOTS 1024
+
+typedef struct {
+  int               node;     // -1 when the job is not placed
+  std::vector<int>  cpus;
+  std::string       how;      // why this node (or none) was chosen
+}                   t_placement;
+
+// "0-3,8,10-11" -> {0, 1, 2, 3, 8, 10, 11}
+static std::vector<int> parse_cpulist(const std::string &s)
+{
+  std::vector<int>  res;
+  const char        *p = s.c_str();
+  char              *end;
+
+  while (*p && *p != '\n')
+  {
+    long first = strtol(p, &end, 10), last;
+
+    if (end == p)
+      break;
+    last = first;
+    p = end;
+    if (*p == '-')
+    {
+      last = strtol(p + 1, &end, 10);
+      p = end;
+    }
+    for (long cpu = first; cpu <= last; cpu++)
+      res.push_back(cpu);
+    if (*p == ',')
+      p++;
+  }
+  return res;
+}
+
+// cpus of every online node the process may run on, indexed by node id (empty for nodes
+// without such cpus)
+static std::vector<std::vector<int>> read_numa_nodes()
+{
+  std::vector<std::vector<int>> nodes;
+  std::string                   line;
+  std::ifstream                 online("/sys/devices/system/node/online");
+  cpu_set_t                     allowed;
+  bool                          have_allowed = (sched_getaffinity(0, sizeof(allowed), &allowed) == 0);
+
+  if (!online || !std::getline(online, line))
+    return nodes;
+  for (int node : parse_cpulist(line))
+  {
+    std::ifstream cpulist("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+    std::string   cpus;
+
+    if (node >= (int)nodes.size())
+      nodes.resize(node + 1);
+    if (!cpulist || !std::getline(cpulist, cpus))
+      continue;
+    for (int cpu : parse_cpulist(cpus))
+      if (!have_allowed || (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)))
+        nodes[node].push_back(cpu);
+  }
+  return nodes;
+}
+
+// the lock directory is shared by the jobs of every user: world writable and sticky like /tmp,
+// whatever the umask
+static void make_lock_dir()
+{
+  if (mkdir(PLACEMENT_LOCK_DIR, 01777) == 0)
+    chmod(PLACEMENT_LOCK_DIR, 01777);
+}
+
+// 1 if the (node, slot) lock was taken, 0 if another job holds it, -1 on error;
+// flock needs no write access, so lock files created by other users can be opened read-only
+static int lock_slot(int node, int slot)
+{
+  std::string path = PLACEMENT_LOCK_DIR "/node" + std::to_string(node) + "." + std::to_string(slot);
+  int         fd = open(path.c_str(), O_RDONLY | O_CREAT | O_CLOEXEC, 0666);
+  int         err;
+
+  if (fd < 0)
+    return -1;
+  if (flock(fd, LOCK_EX | LOCK_NB) == 0)
+    return 1;  // fd stays open, the slot is ours until exit
+  err = errno;
+  close(fd);
+  return (err == EWOULDBLOCK) ? 0 : -1;
+}
+
+// node of the lowest free (node, slot) lock, -1 if none could be taken
+static int pick_least_loaded_node(const std::vector<std::vector<int>> &nodes)
+{
+  make_lock_dir();
+  for (int slot = 0; slot < PLACEMENT_MAX_SLOTS; slot++)
+  {
+    for (size_t node = 0; node < nodes.size(); node++)
+    {
+      int taken;
+
+      if (nodes[node].empty())
+        continue;
+      taken = lock_slot(node, slot);
+      if (taken != 0)
+        return (taken > 0) ? (int)node : -1;
+    }
+  }
+  return -1;
+}
+
+// a requested node counts as a job on it for the automatic ones, running without a slot is fine
+static void occupy_node(int node)
+{
+  make_lock_dir();
+  for (int slot = 0; slot < PLACEMENT_MAX_SLOTS; slot++)
+    if (lock_slot(node, slot) != 0)
+      return;
+}
+
+// requested: PLACEMENT_AUTO, PLACEMENT_OFF or a node id (-N)
+static int apply_placement(int requested, t_placement &placement)
+{
+  std::vector<std::vector<int>> nodes;
+  int                           usable = 0;
+  cpu_set_t                     set;
+
+  placement.node = -1;
+  placement.cpus.clear();
+  if (requested == PLACEMENT_OFF)
+  {
+    placement.how = "off";
+    return 0;
+  }
+  nodes = read_numa_nodes();
+  for (const std::vector<int> &cpus : nodes)
+    usable += !cpus.empty();
+  if (requested == PLACEMENT_AUTO)
+  {
+    if (usable < 2)
+    {
+      placement.how = "single NUMA node";
+      return 0;
+    }
+    placement.node = pick_least_loaded_node(nodes);
+    placement.how = "auto";
+    if (placement.node < 0)
+    {
+      placement.how = "no free placement slot";
+      return 0;
+    }
+  }
+  else
+  {
+    if (requested >= (int)nodes.size() || nodes[requested].empty())
+    {
+      std::cerr << "NUMA node " << requested << " does not exist or has no cpus this job may use" << std::endl;
+      return -1;
+    }
+    placement.node = requested;
+    placement.how = "requested";
+    occupy_node(requested);
+  }
+  placement.cpus = nodes[placement.node];
+
+  CPU_ZERO(&set);
+  for (int cpu : placement.cpus)
+    if (cpu < CPU_SETSIZE)
+      CPU_SET(cpu, &set);
+  if (sched_setaffinity(0, sizeof(set), &set) < 0)
+  {
+    perror("sched_setaffinity");
+    if (requested != PLACEMENT_AUTO)
+      return -1;
+    placement.node = -1;
+    placement.cpus.clear();
+    placement.how = "could not pin to the chosen node";
+    return 0;
+  }
+
+  std::vector<unsigned long> mask(placement.node / (8 * sizeof(unsigned long)) + 1, 0);
+  mask[placement.node / (8 * sizeof(unsigned long))] |= 1UL << (placement.node % (8 * sizeof(unsigned long)));
+  if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask.data(), mask.size() * 8 * sizeof(unsigned long) + 1) < 0)
+    perror("set_mempolicy");  // not fatal, first touch from the pinned cpus still keeps memory local
+  return 0;
+}
+
+// the chosen placement goes to stderr, stdout carries the bits
+static void report_placement(const t_placement &placement)
+{
+  if (placement.node < 0)
+  {
+    std::cerr << "placement: none (" << placement.how << ")" << std::endl;
+    return;
+  }
+  std::cerr << "placement: node " << placement.node << ", cpus ";
+  for (size_t i = 0; i < placement.cpus.size(); i++)
+  {
+    size_t j = i;
+
+    while (j + 1 < placement.cpus.size() && placement.cpus[j + 1] == placement.cpus[j] + 1)
+      j++;
+    std::cerr << (i ? "," : "") << placement.cpus[i];
+    if (j > i)
+      std::cerr << "-" << placement.cpus[j];
+    i = j;
+  }
+  std::cerr << " (" << placement.how << ")" << std::endl;
+}
+
+// -N argument: "auto", "off" or a node id, returns false if it is none of them
+static bool parse_placement(const char *arg, int &requested)
+{
+  char *end;
+
+  if (std::string(arg) == "auto")
+    requested = PLACEMENT_AUTO;
+  else if (std::string(arg) == "off")
+    requested = PLACEMENT_OFF;
+  else
+  {
+    requested = strtol(arg, &end, 10);
+    if (end == arg || *end != '\0' || requested < 0)
+      return false;
+  }
+  return true;
+}
+
+#endif